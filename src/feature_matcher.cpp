@@ -0,0 +1,1344 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#  include <immintrin.h>
+#endif
+
+// A CPU-only replacement for the SiftGPU + exhaustive matching steps. Features
+// are extracted once per image into a memory-mappable .feat cache, so adding
+// images to a dataset only extracts the new ones. Candidate pairs are chosen
+// with preemptive matching on the largest scale features before full matching.
+
+static const int descriptor_length = 128;
+
+struct Keypoint
+{
+  float x;
+  float y;
+  float scale;
+  float orientation;
+};
+
+struct Feature
+{
+  Keypoint keypoint;
+  unsigned char descriptor[descriptor_length];
+};
+
+class Image
+{
+  public:
+    int width;
+    int height;
+    std::vector<float> pixels;
+
+    Image() : width(0), height(0) {}
+    Image(int w, int h) : width(w), height(h), pixels(w * h, 0.0f) {}
+
+    float at(int x, int y) const
+    {
+      return pixels[y * width + x];
+    }
+
+    float& at(int x, int y)
+    {
+      return pixels[y * width + x];
+    }
+
+    bool load_pgm(const std::string& filename);
+    Image blur(float sigma) const;
+    Image downsample() const;
+};
+
+bool Image::load_pgm(const std::string& filename)
+{
+  std::ifstream stream(filename.c_str(), std::ios::binary);
+  if (!stream.is_open()) {
+    return false;
+  }
+
+  std::string magic;
+  stream >> magic;
+  if (magic != "P5") {
+    return false;
+  }
+
+  int header[3];
+  for (int i = 0; i < 3; ++i) {
+    stream >> std::ws;
+    while (stream.peek() == '#') {
+      stream.ignore(4096, '\n');
+      stream >> std::ws;
+    }
+    stream >> header[i];
+  }
+  stream.get();
+
+  width = header[0];
+  height = header[1];
+  int maxval = header[2];
+  if (!stream || width <= 0 || height <= 0 || maxval <= 0 || maxval > 65535) {
+    return false;
+  }
+
+  int sample_size = maxval < 256 ? 1 : 2;
+  std::vector<unsigned char> raw(width * height * sample_size);
+  stream.read(reinterpret_cast<char*>(&raw[0]), raw.size());
+  if (!stream) {
+    return false;
+  }
+
+  pixels.resize(width * height);
+  for (int i = 0; i < width * height; ++i) {
+    int value = sample_size == 1 ? raw[i] : (raw[2 * i] << 8) | raw[2 * i + 1];
+    pixels[i] = static_cast<float>(value) / maxval;
+  }
+  return true;
+}
+
+Image Image::blur(float sigma) const
+{
+  int radius = std::max(1, static_cast<int>(std::ceil(3.0f * sigma)));
+  std::vector<float> kernel(2 * radius + 1);
+  float sum = 0;
+  for (int i = -radius; i <= radius; ++i) {
+    kernel[i + radius] = std::exp(-(i * i) / (2.0f * sigma * sigma));
+    sum += kernel[i + radius];
+  }
+  for (size_t i = 0; i < kernel.size(); ++i) {
+    kernel[i] /= sum;
+  }
+
+  Image horizontal(width, height);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      float value = 0;
+      for (int i = -radius; i <= radius; ++i) {
+        int sx = std::min(std::max(x + i, 0), width - 1);
+        value += kernel[i + radius] * at(sx, y);
+      }
+      horizontal.at(x, y) = value;
+    }
+  }
+
+  Image result(width, height);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      float value = 0;
+      for (int i = -radius; i <= radius; ++i) {
+        int sy = std::min(std::max(y + i, 0), height - 1);
+        value += kernel[i + radius] * horizontal.at(x, sy);
+      }
+      result.at(x, y) = value;
+    }
+  }
+  return result;
+}
+
+Image Image::downsample() const
+{
+  Image result(width / 2, height / 2);
+  for (int y = 0; y < result.height; ++y) {
+    for (int x = 0; x < result.width; ++x) {
+      result.at(x, y) = at(2 * x, 2 * y);
+    }
+  }
+  return result;
+}
+
+// Lowe's SIFT, without the initial upsampling of the input image. Skipping the
+// upsample loses the finest scale features, which are the least useful for
+// matching across photos anyway, and quarters the extraction time.
+class SiftExtractor
+{
+  public:
+    SiftExtractor() :
+      scales_per_octave_(3),
+      initial_sigma_(1.6f),
+      contrast_threshold_(0.04f),
+      edge_threshold_(10.0f),
+      image_border_(5) {}
+    std::vector<Feature> extract(const Image& image) const;
+  private:
+    void find_extrema(const std::vector<Image>& gaussians, const std::vector<Image>& dogs, int octave, std::vector<Feature>& features) const;
+    bool refine(const std::vector<Image>& dogs, int& x, int& y, int& layer, float offset[3]) const;
+    void assign_orientations(const Image& gaussian, float x, float y, float sigma, std::vector<float>& orientations) const;
+    void compute_descriptor(const Image& gaussian, float x, float y, float sigma, float orientation, unsigned char* descriptor) const;
+    int scales_per_octave_;
+    float initial_sigma_;
+    float contrast_threshold_;
+    float edge_threshold_;
+    int image_border_;
+};
+
+std::vector<Feature> SiftExtractor::extract(const Image& image) const
+{
+  std::vector<Feature> features;
+
+  // The camera is assumed to have blurred the image by 0.5 already.
+  float base_sigma = std::sqrt(initial_sigma_ * initial_sigma_ - 0.25f);
+  Image base = image.blur(base_sigma);
+
+  for (int octave = 0; std::min(base.width, base.height) >= 4 * image_border_; ++octave) {
+    std::vector<Image> gaussians;
+    gaussians.push_back(base);
+    for (int s = 1; s < scales_per_octave_ + 3; ++s) {
+      float previous = initial_sigma_ * std::pow(2.0f, static_cast<float>(s - 1) / scales_per_octave_);
+      float current = initial_sigma_ * std::pow(2.0f, static_cast<float>(s) / scales_per_octave_);
+      gaussians.push_back(gaussians.back().blur(std::sqrt(current * current - previous * previous)));
+    }
+
+    std::vector<Image> dogs;
+    for (size_t s = 0; s + 1 < gaussians.size(); ++s) {
+      Image dog(base.width, base.height);
+      for (size_t i = 0; i < dog.pixels.size(); ++i) {
+        dog.pixels[i] = gaussians[s + 1].pixels[i] - gaussians[s].pixels[i];
+      }
+      dogs.push_back(dog);
+    }
+
+    find_extrema(gaussians, dogs, octave, features);
+    base = gaussians[scales_per_octave_].downsample();
+  }
+
+  // Largest scale first, so the preemptive matching set is a prefix.
+  std::stable_sort(features.begin(), features.end(), [](const Feature& a, const Feature& b) {
+    return a.keypoint.scale > b.keypoint.scale;
+  });
+  return features;
+}
+
+void SiftExtractor::find_extrema(const std::vector<Image>& gaussians, const std::vector<Image>& dogs, int octave, std::vector<Feature>& features) const
+{
+  const Image& first = dogs[0];
+  float prethreshold = 0.5f * contrast_threshold_ / scales_per_octave_;
+  float octave_scale = static_cast<float>(1 << octave);
+
+  for (int layer = 1; layer <= scales_per_octave_; ++layer) {
+    for (int y = image_border_; y < first.height - image_border_; ++y) {
+      for (int x = image_border_; x < first.width - image_border_; ++x) {
+        float value = dogs[layer].at(x, y);
+        if (std::fabs(value) <= prethreshold) {
+          continue;
+        }
+
+        bool is_maximum = true;
+        bool is_minimum = true;
+        for (int l = layer - 1; l <= layer + 1 && (is_maximum || is_minimum); ++l) {
+          for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+              if (l == layer && dx == 0 && dy == 0) {
+                continue;
+              }
+              float neighbour = dogs[l].at(x + dx, y + dy);
+              is_maximum = is_maximum && value > neighbour;
+              is_minimum = is_minimum && value < neighbour;
+            }
+          }
+        }
+        if (!is_maximum && !is_minimum) {
+          continue;
+        }
+
+        int rx = x, ry = y, rlayer = layer;
+        float offset[3];
+        if (!refine(dogs, rx, ry, rlayer, offset)) {
+          continue;
+        }
+
+        float octave_x = rx + offset[0];
+        float octave_y = ry + offset[1];
+        float octave_sigma = initial_sigma_ * std::pow(2.0f, (rlayer + offset[2]) / scales_per_octave_);
+
+        std::vector<float> orientations;
+        assign_orientations(gaussians[rlayer], octave_x, octave_y, octave_sigma, orientations);
+        for (size_t i = 0; i < orientations.size(); ++i) {
+          Feature feature;
+          feature.keypoint.x = octave_x * octave_scale;
+          feature.keypoint.y = octave_y * octave_scale;
+          feature.keypoint.scale = octave_sigma * octave_scale;
+          feature.keypoint.orientation = orientations[i];
+          compute_descriptor(gaussians[rlayer], octave_x, octave_y, octave_sigma, orientations[i], feature.descriptor);
+          features.push_back(feature);
+        }
+      }
+    }
+  }
+}
+
+bool SiftExtractor::refine(const std::vector<Image>& dogs, int& x, int& y, int& layer, float offset[3]) const
+{
+  int width = dogs[0].width;
+  int height = dogs[0].height;
+
+  for (int iteration = 0; iteration < 5; ++iteration) {
+    const Image& previous = dogs[layer - 1];
+    const Image& current = dogs[layer];
+    const Image& next = dogs[layer + 1];
+
+    float center = current.at(x, y);
+    float dx = 0.5f * (current.at(x + 1, y) - current.at(x - 1, y));
+    float dy = 0.5f * (current.at(x, y + 1) - current.at(x, y - 1));
+    float ds = 0.5f * (next.at(x, y) - previous.at(x, y));
+    float dxx = current.at(x + 1, y) + current.at(x - 1, y) - 2 * center;
+    float dyy = current.at(x, y + 1) + current.at(x, y - 1) - 2 * center;
+    float dss = next.at(x, y) + previous.at(x, y) - 2 * center;
+    float dxy = 0.25f * (current.at(x + 1, y + 1) - current.at(x - 1, y + 1) - current.at(x + 1, y - 1) + current.at(x - 1, y - 1));
+    float dxs = 0.25f * (next.at(x + 1, y) - next.at(x - 1, y) - previous.at(x + 1, y) + previous.at(x - 1, y));
+    float dys = 0.25f * (next.at(x, y + 1) - next.at(x, y - 1) - previous.at(x, y + 1) + previous.at(x, y - 1));
+
+    // Solve H * offset = -gradient by Cramer's rule.
+    float det = dxx * (dyy * dss - dys * dys) - dxy * (dxy * dss - dys * dxs) + dxs * (dxy * dys - dyy * dxs);
+    if (std::fabs(det) < 1e-12f) {
+      return false;
+    }
+    offset[0] = -(dx * (dyy * dss - dys * dys) - dxy * (dy * dss - dys * ds) + dxs * (dy * dys - dyy * ds)) / det;
+    offset[1] = -(dxx * (dy * dss - ds * dys) - dx * (dxy * dss - dys * dxs) + dxs * (dxy * ds - dy * dxs)) / det;
+    offset[2] = -(dxx * (dyy * ds - dys * dy) - dxy * (dxy * ds - dy * dxs) + dx * (dxy * dys - dyy * dxs)) / det;
+
+    if (std::fabs(offset[0]) < 0.5f && std::fabs(offset[1]) < 0.5f && std::fabs(offset[2]) < 0.5f) {
+      float contrast = center + 0.5f * (dx * offset[0] + dy * offset[1] + ds * offset[2]);
+      if (std::fabs(contrast) * scales_per_octave_ < contrast_threshold_) {
+        return false;
+      }
+
+      // Reject edges, which are poorly localised along the edge direction.
+      float trace = dxx + dyy;
+      float det2 = dxx * dyy - dxy * dxy;
+      return det2 > 0 && trace * trace * edge_threshold_ < (edge_threshold_ + 1) * (edge_threshold_ + 1) * det2;
+    }
+
+    x += static_cast<int>(std::floor(offset[0] + 0.5f));
+    y += static_cast<int>(std::floor(offset[1] + 0.5f));
+    layer += static_cast<int>(std::floor(offset[2] + 0.5f));
+    if (layer < 1 || layer > scales_per_octave_ ||
+        x < image_border_ || x >= width - image_border_ ||
+        y < image_border_ || y >= height - image_border_) {
+      return false;
+    }
+  }
+  return false;
+}
+
+void SiftExtractor::assign_orientations(const Image& gaussian, float x, float y, float sigma, std::vector<float>& orientations) const
+{
+  const int bins = 36;
+  float histogram[bins] = {0};
+  float window_sigma = 1.5f * sigma;
+  int radius = static_cast<int>(std::floor(3.0f * window_sigma + 0.5f));
+  int cx = static_cast<int>(std::floor(x + 0.5f));
+  int cy = static_cast<int>(std::floor(y + 0.5f));
+
+  for (int j = -radius; j <= radius; ++j) {
+    for (int i = -radius; i <= radius; ++i) {
+      int px = cx + i, py = cy + j;
+      if (px <= 0 || px >= gaussian.width - 1 || py <= 0 || py >= gaussian.height - 1) {
+        continue;
+      }
+      float gx = gaussian.at(px + 1, py) - gaussian.at(px - 1, py);
+      float gy = gaussian.at(px, py + 1) - gaussian.at(px, py - 1);
+      float magnitude = std::sqrt(gx * gx + gy * gy);
+      float angle = std::atan2(gy, gx);
+      float weight = std::exp(-(i * i + j * j) / (2.0f * window_sigma * window_sigma));
+      int bin = static_cast<int>(std::floor(bins * (angle + M_PI) / (2 * M_PI))) % bins;
+      histogram[bin] += weight * magnitude;
+    }
+  }
+
+  float smoothed[bins];
+  for (int i = 0; i < bins; ++i) {
+    smoothed[i] = (histogram[(i + bins - 2) % bins] + histogram[(i + 2) % bins]) / 16.0f +
+                  (histogram[(i + bins - 1) % bins] + histogram[(i + 1) % bins]) * 4.0f / 16.0f +
+                  histogram[i] * 6.0f / 16.0f;
+  }
+
+  float maximum = *std::max_element(smoothed, smoothed + bins);
+  for (int i = 0; i < bins; ++i) {
+    float left = smoothed[(i + bins - 1) % bins];
+    float right = smoothed[(i + 1) % bins];
+    if (smoothed[i] > left && smoothed[i] > right && smoothed[i] >= 0.8f * maximum) {
+      float peak = i + 0.5f * (left - right) / (left - 2 * smoothed[i] + right);
+      orientations.push_back(static_cast<float>((peak + 0.5f) * 2 * M_PI / bins - M_PI));
+    }
+  }
+}
+
+void SiftExtractor::compute_descriptor(const Image& gaussian, float x, float y, float sigma, float orientation, unsigned char* descriptor) const
+{
+  const int width = 4;
+  const int bins = 8;
+  float histogram[width * width * bins] = {0};
+
+  float cos_t = std::cos(orientation);
+  float sin_t = std::sin(orientation);
+  float hist_width = 3.0f * sigma;
+  int radius = static_cast<int>(std::floor(hist_width * std::sqrt(2.0f) * (width + 1) * 0.5f + 0.5f));
+  radius = std::min(radius, static_cast<int>(std::sqrt(static_cast<float>(gaussian.width * gaussian.width + gaussian.height * gaussian.height))));
+  int cx = static_cast<int>(std::floor(x + 0.5f));
+  int cy = static_cast<int>(std::floor(y + 0.5f));
+
+  for (int j = -radius; j <= radius; ++j) {
+    for (int i = -radius; i <= radius; ++i) {
+      // Rotate the sample offset into the keypoint frame.
+      float rx = (i * cos_t + j * sin_t) / hist_width;
+      float ry = (-i * sin_t + j * cos_t) / hist_width;
+      float xbin = rx + width / 2 - 0.5f;
+      float ybin = ry + width / 2 - 0.5f;
+      if (xbin <= -1 || xbin >= width || ybin <= -1 || ybin >= width) {
+        continue;
+      }
+
+      int px = cx + i, py = cy + j;
+      if (px <= 0 || px >= gaussian.width - 1 || py <= 0 || py >= gaussian.height - 1) {
+        continue;
+      }
+      float gx = gaussian.at(px + 1, py) - gaussian.at(px - 1, py);
+      float gy = gaussian.at(px, py + 1) - gaussian.at(px, py - 1);
+      float magnitude = std::sqrt(gx * gx + gy * gy);
+      float angle = std::atan2(gy, gx) - orientation;
+      while (angle < 0) {
+        angle += 2 * M_PI;
+      }
+      while (angle >= 2 * M_PI) {
+        angle -= 2 * M_PI;
+      }
+      float obin = angle * bins / (2 * M_PI);
+      float weight = magnitude * std::exp(-(rx * rx + ry * ry) / (2.0f * 0.25f * width * width));
+
+      // Trilinear interpolation into the neighbouring spatial and orientation bins.
+      int x0 = static_cast<int>(std::floor(xbin));
+      int y0 = static_cast<int>(std::floor(ybin));
+      int o0 = static_cast<int>(std::floor(obin));
+      float dx = xbin - x0, dy = ybin - y0, dori = obin - o0;
+      for (int yy = 0; yy <= 1; ++yy) {
+        int yi = y0 + yy;
+        if (yi < 0 || yi >= width) {
+          continue;
+        }
+        float wy = weight * (yy ? dy : 1 - dy);
+        for (int xx = 0; xx <= 1; ++xx) {
+          int xi = x0 + xx;
+          if (xi < 0 || xi >= width) {
+            continue;
+          }
+          float wx = wy * (xx ? dx : 1 - dx);
+          for (int oo = 0; oo <= 1; ++oo) {
+            int oi = (o0 + oo) % bins;
+            histogram[(yi * width + xi) * bins + oi] += wx * (oo ? dori : 1 - dori);
+          }
+        }
+      }
+    }
+  }
+
+  // Normalise, clamp large gradients to reduce lighting effects, and renormalise.
+  float norm = 0;
+  for (int i = 0; i < descriptor_length; ++i) {
+    norm += histogram[i] * histogram[i];
+  }
+  float clamp = 0.2f * std::sqrt(norm);
+  norm = 0;
+  for (int i = 0; i < descriptor_length; ++i) {
+    histogram[i] = std::min(histogram[i], clamp);
+    norm += histogram[i] * histogram[i];
+  }
+  float scale = norm > 0 ? 512.0f / std::sqrt(norm) : 0;
+  for (int i = 0; i < descriptor_length; ++i) {
+    descriptor[i] = static_cast<unsigned char>(std::min(255.0f, histogram[i] * scale));
+  }
+}
+
+// Squared euclidean distance between two quantised descriptors. The largest
+// possible value is 128 * 255^2, which comfortably fits in 32 bits.
+static inline int descriptor_distance(const unsigned char* a, const unsigned char* b)
+{
+#if defined(__AVX2__)
+  __m256i sum = _mm256_setzero_si256();
+  for (int i = 0; i < descriptor_length; i += 16) {
+    __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+    __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+    __m256i difference = _mm256_sub_epi16(va, vb);
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(difference, difference));
+  }
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+#elif defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  __m128i half = _mm_setzero_si128();
+  for (int i = 0; i < descriptor_length; i += 16) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    __m128i low = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+    __m128i high = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+    half = _mm_add_epi32(half, _mm_madd_epi16(low, low));
+    half = _mm_add_epi32(half, _mm_madd_epi16(high, high));
+  }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(half);
+#else
+  int sum = 0;
+  for (int i = 0; i < descriptor_length; ++i) {
+    int difference = static_cast<int>(a[i]) - static_cast<int>(b[i]);
+    sum += difference * difference;
+  }
+  return sum;
+#endif
+}
+
+// Hands out indices [0, count) to a fixed number of worker threads. Work items
+// (images, image pairs) vary wildly in cost, so they are pulled one at a time
+// rather than split into equal blocks up front.
+class ThreadPool
+{
+  public:
+    ThreadPool(unsigned int thread_count) : thread_count_(std::max(1u, thread_count)) {}
+    void run(size_t count, const std::function<void (size_t)>& task) const;
+  private:
+    unsigned int thread_count_;
+};
+
+void ThreadPool::run(size_t count, const std::function<void (size_t)>& task) const
+{
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < std::min<size_t>(thread_count_, count); ++i) {
+    workers.push_back(std::thread([&]() {
+      for (size_t index = next++; index < count; index = next++) {
+        task(index);
+      }
+    }));
+  }
+  for (size_t i = 0; i < workers.size(); ++i) {
+    workers[i].join();
+  }
+}
+
+// On-disk layout of a .feat file: this header, then `count` keypoints, then
+// `count` descriptors of 128 bytes. Keypoints are 16 bytes, so descriptors
+// start 16-byte aligned in the mapping. The source image size and mtime are
+// recorded so a stale cache is detected and re-extracted. A PGM's size rarely
+// changes between edits, so the mtime is kept to the nanosecond.
+struct FeatureCacheHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint32_t width;
+  uint32_t height;
+  uint64_t source_size;
+  int64_t source_mtime;
+  int64_t source_mtime_nsec;
+  char reserved[16];
+};
+
+// Identifies the image a .feat file was extracted from.
+struct FeatureIdentity
+{
+  uint64_t source_size;
+  int64_t source_mtime;
+  int64_t source_mtime_nsec;
+};
+
+static bool operator==(const FeatureIdentity& a, const FeatureIdentity& b)
+{
+  return a.source_size == b.source_size && a.source_mtime == b.source_mtime && a.source_mtime_nsec == b.source_mtime_nsec;
+}
+
+static const char feature_cache_magic[8] = {'S', 'D', 'R', 'F', 'E', 'A', 'T', '\0'};
+static const uint32_t feature_cache_version = 2;
+
+class FeatureCache
+{
+  public:
+    FeatureCache() : data_(0), size_(0), header_(0) {}
+    ~FeatureCache() { close(); }
+    static bool write(const std::string& filename, const struct stat& source, const Image& image, const std::vector<Feature>& features);
+    static bool is_fresh(const std::string& filename, const struct stat& source);
+    bool open(const std::string& filename);
+    void close();
+    size_t count() const { return header_ ? header_->count : 0; }
+    FeatureIdentity identity() const;
+    const Keypoint& keypoint(size_t index) const { return keypoints_[index]; }
+    const unsigned char* descriptor(size_t index) const { return descriptors_ + index * descriptor_length; }
+  private:
+    FeatureCache(const FeatureCache&);
+    FeatureCache& operator=(const FeatureCache&);
+    static bool read_header(const std::string& filename, FeatureCacheHeader& header, off_t& file_size);
+    void* data_;
+    size_t size_;
+    const FeatureCacheHeader* header_;
+    const Keypoint* keypoints_;
+    const unsigned char* descriptors_;
+};
+
+static size_t feature_cache_size(uint32_t count)
+{
+  return sizeof(FeatureCacheHeader) + count * (sizeof(Keypoint) + descriptor_length);
+}
+
+bool FeatureCache::write(const std::string& filename, const struct stat& source, const Image& image, const std::vector<Feature>& features)
+{
+  FeatureCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, feature_cache_magic, sizeof(header.magic));
+  header.version = feature_cache_version;
+  header.count = features.size();
+  header.width = image.width;
+  header.height = image.height;
+  header.source_size = source.st_size;
+  header.source_mtime = source.st_mtime;
+  header.source_mtime_nsec = source.st_mtim.tv_nsec;
+
+  // Write to a temporary file and rename, so an interrupted run never leaves
+  // a truncated cache behind that looks fresh.
+  std::string temporary = filename + ".tmp";
+  std::ofstream stream(temporary.c_str(), std::ios::binary);
+  if (!stream.is_open()) {
+    return false;
+  }
+  stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (size_t i = 0; i < features.size(); ++i) {
+    stream.write(reinterpret_cast<const char*>(&features[i].keypoint), sizeof(Keypoint));
+  }
+  for (size_t i = 0; i < features.size(); ++i) {
+    stream.write(reinterpret_cast<const char*>(features[i].descriptor), descriptor_length);
+  }
+  stream.close();
+  if (!stream) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return std::rename(temporary.c_str(), filename.c_str()) == 0;
+}
+
+bool FeatureCache::read_header(const std::string& filename, FeatureCacheHeader& header, off_t& file_size)
+{
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  bool ok = fstat(fd, &info) == 0 &&
+            read(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header)) &&
+            std::memcmp(header.magic, feature_cache_magic, sizeof(header.magic)) == 0 &&
+            header.version == feature_cache_version &&
+            static_cast<size_t>(info.st_size) == feature_cache_size(header.count);
+  file_size = info.st_size;
+  ::close(fd);
+  return ok;
+}
+
+bool FeatureCache::is_fresh(const std::string& filename, const struct stat& source)
+{
+  FeatureCacheHeader header;
+  off_t file_size;
+  return read_header(filename, header, file_size) &&
+         header.source_size == static_cast<uint64_t>(source.st_size) &&
+         header.source_mtime == static_cast<int64_t>(source.st_mtime) &&
+         header.source_mtime_nsec == static_cast<int64_t>(source.st_mtim.tv_nsec);
+}
+
+bool FeatureCache::open(const std::string& filename)
+{
+  close();
+  FeatureCacheHeader header;
+  off_t file_size;
+  if (!read_header(filename, header, file_size)) {
+    return false;
+  }
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  void* data = mmap(0, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  data_ = data;
+  size_ = file_size;
+  header_ = static_cast<const FeatureCacheHeader*>(data_);
+  keypoints_ = reinterpret_cast<const Keypoint*>(header_ + 1);
+  descriptors_ = reinterpret_cast<const unsigned char*>(keypoints_ + header_->count);
+  return true;
+}
+
+FeatureIdentity FeatureCache::identity() const
+{
+  FeatureIdentity identity;
+  identity.source_size = header_->source_size;
+  identity.source_mtime = header_->source_mtime;
+  identity.source_mtime_nsec = header_->source_mtime_nsec;
+  return identity;
+}
+
+void FeatureCache::close()
+{
+  if (data_) {
+    munmap(data_, size_);
+  }
+  data_ = 0;
+  size_ = 0;
+  header_ = 0;
+}
+
+// Writes a Lowe-format ASCII keyfile, as read by Bundler. Like the .feat
+// cache, it goes through a temporary file so a partial keyfile never looks
+// newer than its features.
+static bool write_keyfile(const std::string& filename, const FeatureCache& cache)
+{
+  std::string temporary = filename + ".tmp";
+  std::ofstream stream(temporary.c_str());
+  if (!stream.is_open()) {
+    return false;
+  }
+  stream << cache.count() << " " << descriptor_length << "\n";
+  for (size_t i = 0; i < cache.count(); ++i) {
+    const Keypoint& keypoint = cache.keypoint(i);
+    stream << keypoint.y << " " << keypoint.x << " " << keypoint.scale << " " << keypoint.orientation;
+    const unsigned char* descriptor = cache.descriptor(i);
+    for (int j = 0; j < descriptor_length; ++j) {
+      stream << (j % 20 == 0 ? "\n " : " ") << static_cast<int>(descriptor[j]);
+    }
+    stream << "\n";
+  }
+  stream.close();
+  if (!stream) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return std::rename(temporary.c_str(), filename.c_str()) == 0;
+}
+
+// True if `filename` is missing or was modified before `reference`.
+static bool is_older(const std::string& filename, const struct stat& reference)
+{
+  struct stat info;
+  if (stat(filename.c_str(), &info) != 0) {
+    return true;
+  }
+  if (info.st_mtime != reference.st_mtime) {
+    return info.st_mtime < reference.st_mtime;
+  }
+  return info.st_mtim.tv_nsec < reference.st_mtim.tv_nsec;
+}
+
+typedef std::vector<std::pair<size_t, size_t> > Matches;
+
+// The outcome of matching one image pair. `candidate` is false when the pair
+// was rejected by preemptive matching, and so never fully matched.
+struct PairResult
+{
+  PairResult() : done(false), candidate(false) {}
+  bool done;
+  bool candidate;
+  Matches matches;
+};
+
+// The matching parameters a match cache was built with. A cache built with
+// different parameters, or from a different feature format, is discarded.
+struct MatchCacheHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t feature_version;
+  uint32_t preemptive_features;
+  uint32_t preemptive_threshold;
+  float ratio;
+  char reserved[4];
+};
+
+static const char match_cache_magic[8] = {'S', 'D', 'R', 'M', 'A', 'T', 'C', '\0'};
+static const uint32_t match_cache_version = 1;
+
+// Pair results of a directory, keyed on both images' names and identities, so
+// adding or changing an image only rematches the pairs it is part of. Records
+// follow the header, each one being:
+//   name length, name, identity    (first image)
+//   name length, name, identity    (second image)
+//   candidate flag, match count, count * (first index, second index)
+// Records are appended as pairs finish, so an interrupted run loses nothing
+// already matched. Stale records are dropped when the file is compacted.
+class MatchCache
+{
+  public:
+    MatchCache(const std::string& filename, const MatchCacheHeader& header) : filename_(filename), header_(header) {}
+    size_t load(const std::vector<std::string>& names, const std::vector<FeatureIdentity>& identities, std::vector<PairResult>& results, bool& needs_compaction);
+    bool open_for_append(bool fresh);
+    bool append(const std::string& name_a, const FeatureIdentity& a, const std::string& name_b, const FeatureIdentity& b, const PairResult& result);
+    bool rewrite(const std::vector<std::string>& names, const std::vector<FeatureIdentity>& identities, const std::vector<PairResult>& results);
+  private:
+    static void encode(const std::string& name_a, const FeatureIdentity& a, const std::string& name_b, const FeatureIdentity& b, const PairResult& result, std::string& record);
+    std::string filename_;
+    MatchCacheHeader header_;
+    std::ofstream stream_;
+    std::mutex mutex_;
+};
+
+// Index of pair (i, j), i < j, in the row-major list of all pairs of n images.
+static size_t pair_index(size_t i, size_t j, size_t n)
+{
+  return i * n - i * (i + 1) / 2 + (j - i - 1);
+}
+
+template <typename Type>
+static bool read_value(std::istream& stream, Type& value)
+{
+  return static_cast<bool>(stream.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+static bool read_name(std::istream& stream, std::string& name)
+{
+  uint32_t length;
+  if (!read_value(stream, length) || length > 4096) {
+    return false;
+  }
+  name.resize(length);
+  return length == 0 || static_cast<bool>(stream.read(&name[0], length));
+}
+
+template <typename Type>
+static void append_value(std::string& record, const Type& value)
+{
+  record.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Returns the number of pair results recovered. `needs_compaction` is set
+// when the file holds records that no longer apply, or is unusable.
+size_t MatchCache::load(const std::vector<std::string>& names, const std::vector<FeatureIdentity>& identities, std::vector<PairResult>& results, bool& needs_compaction)
+{
+  needs_compaction = true;
+  std::ifstream stream(filename_.c_str(), std::ios::binary);
+  MatchCacheHeader header;
+  if (!stream.is_open() || !read_value(stream, header) || std::memcmp(&header, &header_, sizeof(header)) != 0) {
+    return 0;
+  }
+  needs_compaction = false;
+
+  std::map<std::string, size_t> indices;
+  for (size_t i = 0; i < names.size(); ++i) {
+    indices[names[i]] = i;
+  }
+
+  size_t loaded = 0;
+  std::streamoff valid_size = stream.tellg();
+  for (;;) {
+    std::string name_a, name_b;
+    FeatureIdentity a, b;
+    uint32_t candidate, count;
+    if (!read_name(stream, name_a) || !read_value(stream, a) ||
+        !read_name(stream, name_b) || !read_value(stream, b) ||
+        !read_value(stream, candidate) || !read_value(stream, count)) {
+      break;
+    }
+    std::vector<uint32_t> pairs(2 * count);
+    if (count > 0 && !stream.read(reinterpret_cast<char*>(&pairs[0]), pairs.size() * sizeof(uint32_t))) {
+      break;
+    }
+    valid_size = stream.tellg();
+
+    std::map<std::string, size_t>::const_iterator ia = indices.find(name_a), ib = indices.find(name_b);
+    if (ia == indices.end() || ib == indices.end() || ia->second >= ib->second ||
+        !(identities[ia->second] == a) || !(identities[ib->second] == b)) {
+      needs_compaction = true;
+      continue;
+    }
+    PairResult& result = results[pair_index(ia->second, ib->second, names.size())];
+    if (result.done) {
+      needs_compaction = true;
+    }
+    else {
+      ++loaded;
+    }
+    result.done = true;
+    result.candidate = candidate != 0;
+    result.matches.resize(count);
+    for (size_t m = 0; m < count; ++m) {
+      result.matches[m] = std::make_pair(pairs[2 * m], pairs[2 * m + 1]);
+    }
+  }
+
+  // Drop a record cut short by an interrupted run, so appends follow a
+  // complete record.
+  stream.close();
+  if (valid_size >= 0 && truncate(filename_.c_str(), valid_size) != 0) {
+    needs_compaction = true;
+  }
+  return loaded;
+}
+
+bool MatchCache::open_for_append(bool fresh)
+{
+  if (fresh) {
+    stream_.open(filename_.c_str(), std::ios::binary | std::ios::trunc);
+    stream_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+  }
+  else {
+    stream_.open(filename_.c_str(), std::ios::binary | std::ios::app);
+  }
+  stream_.flush();
+  return static_cast<bool>(stream_);
+}
+
+void MatchCache::encode(const std::string& name_a, const FeatureIdentity& a, const std::string& name_b, const FeatureIdentity& b, const PairResult& result, std::string& record)
+{
+  record.clear();
+  append_value(record, static_cast<uint32_t>(name_a.size()));
+  record.append(name_a);
+  append_value(record, a);
+  append_value(record, static_cast<uint32_t>(name_b.size()));
+  record.append(name_b);
+  append_value(record, b);
+  append_value(record, static_cast<uint32_t>(result.candidate));
+  append_value(record, static_cast<uint32_t>(result.matches.size()));
+  for (size_t m = 0; m < result.matches.size(); ++m) {
+    append_value(record, static_cast<uint32_t>(result.matches[m].first));
+    append_value(record, static_cast<uint32_t>(result.matches[m].second));
+  }
+}
+
+bool MatchCache::append(const std::string& name_a, const FeatureIdentity& a, const std::string& name_b, const FeatureIdentity& b, const PairResult& result)
+{
+  std::string record;
+  encode(name_a, a, name_b, b, result, record);
+  std::lock_guard<std::mutex> lock(mutex_);
+  stream_.write(record.data(), record.size());
+  stream_.flush();
+  return static_cast<bool>(stream_);
+}
+
+bool MatchCache::rewrite(const std::vector<std::string>& names, const std::vector<FeatureIdentity>& identities, const std::vector<PairResult>& results)
+{
+  stream_.close();
+  std::string temporary = filename_ + ".tmp";
+  std::ofstream stream(temporary.c_str(), std::ios::binary);
+  if (!stream.is_open()) {
+    return false;
+  }
+  stream.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+  std::string record;
+  for (size_t i = 0; i < names.size(); ++i) {
+    for (size_t j = i + 1; j < names.size(); ++j) {
+      const PairResult& result = results[pair_index(i, j, names.size())];
+      if (result.done) {
+        encode(names[i], identities[i], names[j], identities[j], result, record);
+        stream.write(record.data(), record.size());
+      }
+    }
+  }
+  stream.close();
+  if (!stream) {
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return std::rename(temporary.c_str(), filename_.c_str()) == 0;
+}
+
+// Matches the first `limit_a` features of `a` against the first `limit_b`
+// features of `b` with Lowe's ratio test. Features in `b` claimed by more than
+// one feature in `a` are ambiguous and dropped.
+static void match_features(const FeatureCache& a, size_t limit_a, const FeatureCache& b, size_t limit_b, float ratio, Matches& matches)
+{
+  matches.clear();
+  if (limit_b < 2) {
+    return;
+  }
+
+  float ratio_squared = ratio * ratio;
+  std::vector<int> claims(limit_b, 0);
+  for (size_t i = 0; i < limit_a; ++i) {
+    const unsigned char* descriptor = a.descriptor(i);
+    int best = 0x7fffffff, second = 0x7fffffff;
+    size_t best_index = 0;
+    for (size_t j = 0; j < limit_b; ++j) {
+      int distance = descriptor_distance(descriptor, b.descriptor(j));
+      if (distance < best) {
+        second = best;
+        best = distance;
+        best_index = j;
+      }
+      else if (distance < second) {
+        second = distance;
+      }
+    }
+    if (best < ratio_squared * second) {
+      matches.push_back(std::make_pair(i, best_index));
+      ++claims[best_index];
+    }
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < matches.size(); ++i) {
+    if (claims[matches[i].second] == 1) {
+      matches[kept++] = matches[i];
+    }
+  }
+  matches.resize(kept);
+}
+
+// Case-sensitive, so `x.pgm` and `x.PGM` cannot both claim `x.feat` and `x.key`.
+static bool has_suffix(const std::string& name, const std::string& suffix)
+{
+  return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool parse_count(const char* text, size_t& count)
+{
+  char* end;
+  errno = 0;
+  unsigned long value = std::strtoul(text, &end, 10);
+  if (*text == '\0' || *end != '\0' || errno != 0 || std::strchr(text, '-')) {
+    return false;
+  }
+  count = value;
+  return true;
+}
+
+static std::string replace_extension(const std::string& filename, const std::string& extension)
+{
+  size_t dot = filename.find_last_of('.');
+  return filename.substr(0, dot) + extension;
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned int jobs = std::thread::hardware_concurrency();
+  size_t preemptive_features = 100;
+  size_t preemptive_threshold = 4;
+  size_t minimum_matches = 16;
+  float ratio = 0.8f;
+  bool write_keyfiles = false;
+  const char* ofilename = "matches.init.txt";
+
+  int argi;
+  for (argi = 1; argi < argc; ++argi) {
+
+    if (argv[argi][0] != '-') {
+      break;
+    }
+    if (argv[argi][1] == 0) {
+      ++argi;
+      break;
+    }
+    char* option = argv[argi];
+    char short_opt, *long_opt, *opt_arg;
+    if (argv[argi][1] != '-') {
+      short_opt = argv[argi][1];
+      opt_arg = &argv[argi][2];
+      long_opt = &argv[argi][2];
+      while (*long_opt != '\0') {
+        ++long_opt;
+      }
+      if ((*opt_arg == '\0') && std::strchr("jptmro", short_opt) && (argi + 1 < argc)) {
+        opt_arg = argv[++argi];
+      }
+    }
+    else {
+      short_opt = 0;
+      long_opt = &argv[argi][2];
+      opt_arg = long_opt;
+      while ((*opt_arg != '=') && (*opt_arg != '\0')) {
+        ++opt_arg;
+      }
+      if (*opt_arg == '=') {
+        *opt_arg++ = '\0';
+      }
+    }
+
+    if ((short_opt == 'h') || (std::strcmp(long_opt, "help") == 0)) {
+      std::cout << "Usage: feature_matcher [OPTION] [DIRECTORY]\n";
+      std::cout << "Extract SIFT features from every .pgm image in DIRECTORY, and match image pairs.\n";
+      std::cout << "\n";
+      std::cout << "  -h, --help              display this help and exit\n";
+      std::cout << "  -v, --version           output version information and exit\n";
+      std::cout << "  -j, --jobs=N            number of worker threads (default: all cores)\n";
+      std::cout << "  -p, --preemptive=K      preemptively match the K largest scale features (default: 100)\n";
+      std::cout << "  -t, --threshold=N       fully match pairs with at least N preemptive matches (default: 4)\n";
+      std::cout << "  -m, --min-matches=N     only output pairs with at least N matches (default: 16)\n";
+      std::cout << "  -r, --ratio=R           nearest neighbour distance ratio (default: 0.8)\n";
+      std::cout << "  -k, --keys              also write Lowe format .key files for Bundler\n";
+      std::cout << "  -o, --output=FILE       write matches to FILE (default: matches.init.txt)\n";
+      std::cout << "\n";
+      std::cout << "Short options take their value either attached or as the next argument,\n";
+      std::cout << "e.g. -m4 or -m 4.\n";
+      std::cout << "Features are cached next to each image in a .feat file, and are only\n";
+      std::cout << "re-extracted when the image changes. Pair results are cached in\n";
+      std::cout << "DIRECTORY/matches.cache, so only pairs involving a new or changed image\n";
+      std::cout << "are matched again. Changing -p, -t or -r rematches every pair. A\n";
+      std::cout << "preemptive K of 0 matches all pairs.\n";
+      std::cout << "Only names ending in a lowercase .pgm are read. With no DIRECTORY, the\n";
+      std::cout << "current directory is used.\n";
+      return EXIT_SUCCESS;
+    }
+
+    else if ((short_opt == 'v') || (std::strcmp(long_opt, "version") == 0)) {
+      std::cout << "feature_matcher v0.1\n";
+      return EXIT_SUCCESS;
+    }
+
+    else if ((short_opt == 'j') || (std::strcmp(long_opt, "jobs") == 0)) {
+      size_t count;
+      if (!parse_count(opt_arg, count) || count == 0) {
+        std::cerr << "feature_matcher: " << "invalid option `" << option << "'" << "\n";
+        std::cerr << "Try `" << argv[0] << " --help' for more information.\n";
+        return EXIT_FAILURE;
+      }
+      jobs = count;
+    }
+
+    else if ((short_opt == 'p') || (std::strcmp(long_opt, "preemptive") == 0)) {
+      if (!parse_count(opt_arg, preemptive_features)) {
+        std::cerr << "feature_matcher: " << "invalid option `" << option << "'" << "\n";
+        std::cerr << "Try `" << argv[0] << " --help' for more information.\n";
+        return EXIT_FAILURE;
+      }
+    }
+
+    else if ((short_opt == 't') || (std::strcmp(long_opt, "threshold") == 0)) {
+      if (!parse_count(opt_arg, preemptive_threshold)) {
+        std::cerr << "feature_matcher: " << "invalid option `" << option << "'" << "\n";
+        std::cerr << "Try `" << argv[0] << " --help' for more information.\n";
+        return EXIT_FAILURE;
+      }
+    }
+
+    else if ((short_opt == 'm') || (std::strcmp(long_opt, "min-matches") == 0)) {
+      if (!parse_count(opt_arg, minimum_matches)) {
+        std::cerr << "feature_matcher: " << "invalid option `" << option << "'" << "\n";
+        std::cerr << "Try `" << argv[0] << " --help' for more information.\n";
+        return EXIT_FAILURE;
+      }
+    }
+
+    else if ((short_opt == 'r') || (std::strcmp(long_opt, "ratio") == 0)) {
+      char* end;
+      ratio = std::strtof(opt_arg, &end);
+      if (*opt_arg == '\0' || *end != '\0' || !(ratio > 0 && ratio <= 1)) {
+        std::cerr << "feature_matcher: " << "invalid option `" << option << "'" << "\n";
+        std::cerr << "Try `" << argv[0] << " --help' for more information.\n";
+        return EXIT_FAILURE;
+      }
+    }
+
+    else if ((short_opt == 'k') || (std::strcmp(long_opt, "keys") == 0)) {
+      write_keyfiles = true;
+    }
+
+    else if ((short_opt == 'o') || (std::strcmp(long_opt, "output") == 0)) {
+      ofilename = opt_arg;
+    }
+
+    else {
+      std::cerr << "feature_matcher: " << "invalid option `" << option << "'" << "\n";
+      std::cerr << "Try `" << argv[0] << " --help' for more information.\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  int parc = argc - argi;
+  char** parv = argv + argi;
+  if (parc > 1) {
+    std::cerr << "feature_matcher: " << "too many parameters" << "\n";
+    std::cerr << "Try `" << argv[0] << " --help' for more information.\n";
+    return EXIT_FAILURE;
+  }
+
+  std::string directory = parc > 0 ? parv[0] : ".";
+  DIR* dir = opendir(directory.c_str());
+  if (!dir) {
+    std::cerr << "feature_matcher: " << directory << ": " << "no such file or directory" << "\n";
+    return EXIT_FAILURE;
+  }
+  std::vector<std::string> names;
+  for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+    if (has_suffix(entry->d_name, ".pgm")) {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+  std::vector<std::string> images;
+  for (size_t i = 0; i < names.size(); ++i) {
+    images.push_back(directory + "/" + names[i]);
+  }
+
+  if (images.size() < 2) {
+    std::cerr << "feature_matcher: " << directory << ": " << "need at least two .pgm images" << "\n";
+    return EXIT_FAILURE;
+  }
+
+  ThreadPool pool(jobs);
+
+  // Extraction is embarrassingly parallel, one image per task. Keyfiles are
+  // written here too, and only when their features were re-extracted.
+  std::atomic<size_t> extracted(0);
+  std::atomic<bool> failed(false);
+  pool.run(images.size(), [&](size_t i) {
+    struct stat source;
+    std::string cachename = replace_extension(images[i], ".feat");
+    std::string keyname = replace_extension(images[i], ".key");
+    if (stat(images[i].c_str(), &source) != 0) {
+      std::cerr << "feature_matcher: " << images[i] << ": " << "no such file or directory" << "\n";
+      failed = true;
+      return;
+    }
+    if (FeatureCache::is_fresh(cachename, source)) {
+      struct stat cached;
+      if (write_keyfiles && stat(cachename.c_str(), &cached) == 0 && is_older(keyname, cached)) {
+        FeatureCache cache;
+        if (!cache.open(cachename) || !write_keyfile(keyname, cache)) {
+          std::cerr << "feature_matcher: " << keyname << ": " << "could not open file" << "\n";
+          failed = true;
+        }
+      }
+      return;
+    }
+    Image image;
+    if (!image.load_pgm(images[i])) {
+      std::cerr << "feature_matcher: " << images[i] << ": " << "not a binary PGM image" << "\n";
+      failed = true;
+      return;
+    }
+    std::vector<Feature> features = SiftExtractor().extract(image);
+    if (!FeatureCache::write(cachename, source, image, features)) {
+      std::cerr << "feature_matcher: " << cachename << ": " << "could not open file" << "\n";
+      failed = true;
+      return;
+    }
+    if (write_keyfiles) {
+      FeatureCache cache;
+      if (!cache.open(cachename) || !write_keyfile(keyname, cache)) {
+        std::cerr << "feature_matcher: " << keyname << ": " << "could not open file" << "\n";
+        failed = true;
+        return;
+      }
+    }
+    ++extracted;
+  });
+  if (failed) {
+    return EXIT_FAILURE;
+  }
+  std::cout << "Extracted features: " << extracted << " of " << images.size() << " images (rest cached)\n";
+
+  std::vector<FeatureCache> caches(images.size());
+  std::vector<FeatureIdentity> identities(images.size());
+  for (size_t i = 0; i < images.size(); ++i) {
+    std::string cachename = replace_extension(images[i], ".feat");
+    if (!caches[i].open(cachename)) {
+      std::cerr << "feature_matcher: " << cachename << ": " << "could not open file" << "\n";
+      return EXIT_FAILURE;
+    }
+    identities[i] = caches[i].identity();
+  }
+
+  std::vector<std::pair<size_t, size_t> > pairs;
+  for (size_t i = 0; i < images.size(); ++i) {
+    for (size_t j = i + 1; j < images.size(); ++j) {
+      pairs.push_back(std::make_pair(i, j));
+    }
+  }
+
+  MatchCacheHeader match_cache_header;
+  std::memset(&match_cache_header, 0, sizeof(match_cache_header));
+  std::memcpy(match_cache_header.magic, match_cache_magic, sizeof(match_cache_header.magic));
+  match_cache_header.version = match_cache_version;
+  match_cache_header.feature_version = feature_cache_version;
+  match_cache_header.preemptive_features = preemptive_features;
+  match_cache_header.preemptive_threshold = preemptive_threshold;
+  match_cache_header.ratio = ratio;
+
+  // Only pairs involving a new or changed image are matched again.
+  std::string match_cachename = directory + "/matches.cache";
+  MatchCache match_cache(match_cachename, match_cache_header);
+  std::vector<PairResult> results(pairs.size());
+  bool needs_compaction;
+  size_t cached = match_cache.load(names, identities, results, needs_compaction);
+  if (!match_cache.open_for_append(cached == 0)) {
+    std::cerr << "feature_matcher: " << match_cachename << ": " << "could not open file" << "\n";
+    return EXIT_FAILURE;
+  }
+
+  // Each pair is first matched on its largest scale features only. Pairs that
+  // do not share enough of them are unlikely to overlap, and skip full matching.
+  pool.run(pairs.size(), [&](size_t p) {
+    PairResult& result = results[p];
+    if (result.done) {
+      return;
+    }
+    size_t i = pairs[p].first, j = pairs[p].second;
+    const FeatureCache& a = caches[i];
+    const FeatureCache& b = caches[j];
+    result.candidate = true;
+    if (preemptive_features > 0) {
+      Matches preemptive;
+      match_features(a, std::min(preemptive_features, a.count()), b, std::min(preemptive_features, b.count()), ratio, preemptive);
+      result.candidate = preemptive.size() >= preemptive_threshold;
+    }
+    if (result.candidate) {
+      match_features(a, a.count(), b, b.count(), ratio, result.matches);
+    }
+    result.done = true;
+    if (!match_cache.append(names[i], identities[i], names[j], identities[j], result)) {
+      failed = true;
+    }
+  });
+  if (failed) {
+    std::cerr << "feature_matcher: " << match_cachename << ": " << "could not write file" << "\n";
+    return EXIT_FAILURE;
+  }
+  if (needs_compaction && cached > 0 && !match_cache.rewrite(names, identities, results)) {
+    std::cerr << "feature_matcher: " << match_cachename << ": " << "could not write file" << "\n";
+    return EXIT_FAILURE;
+  }
+  std::cout << "Matched pairs: " << pairs.size() - cached << " of " << pairs.size() << " pairs (rest cached)\n";
+
+  std::ofstream ostream(ofilename);
+  if (!ostream.is_open()) {
+    std::cerr << "feature_matcher: " << ofilename << ": " << "could not open file" << "\n";
+    return EXIT_FAILURE;
+  }
+  size_t candidates = 0;
+  size_t matched = 0;
+  for (size_t p = 0; p < pairs.size(); ++p) {
+    const Matches& matches = results[p].matches;
+    candidates += results[p].candidate;
+    if (matches.size() < minimum_matches) {
+      continue;
+    }
+    ++matched;
+    ostream << pairs[p].first << " " << pairs[p].second << "\n";
+    ostream << matches.size() << "\n";
+    for (size_t m = 0; m < matches.size(); ++m) {
+      ostream << matches[m].first << " " << matches[m].second << "\n";
+    }
+  }
+
+  std::cout << "Candidate pairs after preemptive matching: " << candidates << " of " << pairs.size() << "\n";
+  std::cout << "Pairs with at least " << minimum_matches << " matches: " << matched << "\n";
+  return EXIT_SUCCESS;
+}